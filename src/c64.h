@@ -22,6 +22,8 @@
 #define VARTAB 0x2D
 #define MEMSIZE          0x37          // Pointer to highest BASIC RAM location (+1)
 #define TXTPTR           0x7A          // Pointer into BASIC source code
+#define STKEY            0x91          // Stop key flag
+#define STKEY_RUN_STOP   0x80          // Clear while RUN/STOP is down
 #define TIME             0xA0          // 60 HZ clock
 #define FNAM_LEN         0xB7          // Length of filename
 #define SECADR           0xB9          // Secondary address
@@ -56,6 +58,10 @@
 
 #define SCREEN_SPRITE_BORDER_WIDTH (SCREEN_SPRITE_BORDER_X_END - SCREEN_SPRITE_BORDER_X_START)
 
+// Sprite coordinates of the top left of the text screen
+#define SCREEN_SPRITE_CHAR_X_START 24
+#define SCREEN_SPRITE_CHAR_Y_START 50
+
 #define BASIC_BUF        0x200         // Location of command-line
 #define BASIC_BUF_LEN    89            // Maximum length of command-line
 
@@ -138,6 +144,8 @@
 #define VIC_CTRL1_BITMAP_ON     0x20
 #define VIC_CTRL1_HLINE_MSB     0x80
 #define VIC_CTRL2_MULTICOLOR_ON 0x10
+#define VIC_CTRL2_COLUMNS_40    0x08
+#define VIC_CTRL2_XSCROLL_MASK  0x07
 
 #define VIC_HLINE        0xD012
 
@@ -245,6 +253,11 @@
 
 #define CIA1_CR_START_STOP 0x01
 
+// Joystick 2 is on port A, joystick 1 on port B. Bits are low when pressed.
+#define CIA1_JOY2        CIA1_PRA
+#define CIA1_JOY1        CIA1_PRB
+#define CIA1_JOY_MASK    0x1F
+
 #define CIA2_PRA_VIC_BANK0 0x02
 #define CIA2_PRA_VIC_BANK1 0x01
 
@@ -0,0 +1,37 @@
+; Minimal KERNAL replacements for the bits of conio we use. Files go through
+; cc65's cbm_* wrappers. Only assembled into the lean build, see SConstruct.
+
+.ifdef LEAN
+
+.export _kernal_puts, _kernal_clrscr
+.importzp ptr1
+.include "c64.inc"
+
+.define CH_CLR #$93
+
+.segment "CODE"
+
+; ARG A/X = pointer to a zero terminated string
+; Prints the string at the cursor
+.proc _kernal_puts
+    sta ptr1
+    stx ptr1+1
+
+    ldy #$00
+loop:
+    lda (ptr1),Y
+    beq done
+    jsr CHROUT
+    iny
+    bne loop
+done:
+    rts
+.endproc
+
+; Clears the screen and homes the cursor
+.proc _kernal_clrscr
+    lda CH_CLR
+    jmp CHROUT
+.endproc
+
+.endif
@@ -5,11 +5,17 @@
 #include <6502.h>
 #include <conio.h>
 #include <c64.h>
+#include <cbm.h>
 #include "c64.h"
 #include <errno.h>
 
 extern void updatepalntsc(void);
 
+#ifdef LEAN
+extern void kernal_puts(unsigned char* s);
+extern void kernal_clrscr(void);
+#endif
+
 /* Check if system is PAL
  */
 void pal_system(void) {
@@ -73,15 +79,22 @@ void screen_init (bool clear) {
     VIC.imr |= VIC_IRQ_RASTER;
 
     if(clear) {
+#ifdef LEAN
+        kernal_clrscr();
+        kernal_puts("hallo!");
+#else
         clrscr();
         printf("hallo!");
+#endif
 
         VIC.bgcolor0 = COLOR_BLACK;
         VIC.bgcolor1 = COLOR_BLACK;
         VIC.bgcolor2 = COLOR_BLACK;
         VIC.bgcolor3 = COLOR_BLACK;
         VIC.bordercolor = COLOR_BLACK;
+#ifndef LEAN
         bordercolor(COLOR_BLACK);
+#endif
     }
 }
 
@@ -120,8 +133,65 @@ struct spd {
 };
 typedef struct spd spd;
 
-#define SPRITE_MAX 80
+// Sprites that fit between the sheet's header block and the character set
+#define SPRITE_MAX ((CHARACTER_START - SPRITE_START) / VIC_SPR_SIZE - 1)
+
+#define DISK_DEVICE_DEFAULT 8
+
+/* The drive the program was loaded from
+ */
+unsigned char disk_device(void) {
+    static unsigned char device;
+
+    device = *(unsigned char *)DEVNUM;
+    return device ? device : DISK_DEVICE_DEFAULT;
+}
+
+#ifdef LEAN
+#define SPD_LFN 2
+#define SPD_SA 2
+
+/* Load a sprite sheet in SpritePad format, using the cbm_* KERNAL wrappers
+ * @param filename - The filename on disk
+ * @return - Whether the sheet successfully loaded into memory.
+ */
+unsigned char spritesheet_load(unsigned char* filename) {
+    static unsigned char header[VIC_SPR_SIZE];
+    static spd* spd_data;
+    static unsigned char err;
+
+    if(err = cbm_open(SPD_LFN, disk_device(), SPD_SA, filename)) {
+        cbm_close(SPD_LFN);
+        return err;
+    }
+
+    if(cbm_read(SPD_LFN, header + SPD_PADDING, VIC_SPR_SIZE - SPD_PADDING) <= 0) {
+        cbm_close(SPD_LFN);
+        return EXIT_FAILURE;
+    }
+
+    spd_data = (spd*)header;
+
+    if(spd_data->sprite_count + 1 > SPRITE_MAX) {
+        cbm_close(SPD_LFN);
+        return EXIT_FAILURE;
+    }
+
+    memcpy(SPRITE_START, header, VIC_SPR_SIZE);
+
+    if(cbm_read(SPD_LFN, SPRITE_START + VIC_SPR_SIZE, VIC_SPR_SIZE * (spd_data->sprite_count + 1)) <= 0) {
+        cbm_close(SPD_LFN);
+        return EXIT_FAILURE;
+    }
+
+    VIC.spr_mcolor0 = spd_data->multicolor_0;
+    VIC.spr_mcolor1 = spd_data->multicolor_1;
+
+    cbm_close(SPD_LFN);
 
+    return EXIT_SUCCESS;
+}
+#else
 /* Load a sprite sheet in SpritePad format
  * @param filename - The filename on disk
  * @return - Whether the sheet successfully loaded into memory.
@@ -173,6 +243,7 @@ unsigned char spritesheet_load(unsigned char* filename) {
 
     return EXIT_SUCCESS;
 }
+#endif
 
 #define SPD_SPRITE_MULTICOLOR_ENABLE_MASK 0x80
 #define SPD_SPRITE_COLOR_VALUE_MASK 0x0F
@@ -187,6 +258,9 @@ struct sprite_data {
     unsigned char hi_x;
     unsigned char dbl;
     unsigned char multi;
+
+    // Drawn into the character set instead of by the multiplexer
+    unsigned char soft;
 };
 typedef struct sprite_data* sprite_handle;
 
@@ -360,6 +434,675 @@ sprite_handle new_sprite(bool dbl) {
     return handle;
 }
 
+#define PLAYFIELD_PHASES 8
+// Rows of the back buffer rebuilt per frame. The last phase only flips.
+#define PLAYFIELD_SLICE_ROWS ((YSIZE + PLAYFIELD_PHASES - 2) / (PLAYFIELD_PHASES - 1))
+
+#define PLAYFIELD_BRICK_ROW (YSIZE - 1)
+#define PLAYFIELD_HILL_COUNT 16
+#define SCREEN_CODE_SPACE 0x20
+#define SCREEN_CODE_BLOCK 0xA0
+#define SCREEN_CODE_CHECKER 0x66
+
+// The screen being shown and the one being built
+unsigned char* screen_front = (unsigned char*)SCREEN_START;
+unsigned char* screen_back = (unsigned char*)SCREEN2_START;
+
+// Read by the raster IRQ when the game clock ticks.
+// playfield_flip is the high byte of the screen to switch to, or 0.
+unsigned char playfield_flip = 0;
+unsigned char playfield_ctrl2 = VIC_CTRL2_COLUMNS_40;
+
+unsigned char playfield_phase = 0;
+// Set on the flip. The IRQ takes the new column's colors from
+// playfield_colors, after that the next map column can be generated.
+bool playfield_column_pending = false;
+
+// The map column scrolling in at the right edge
+unsigned int playfield_column;
+unsigned char playfield_codes[YSIZE];
+unsigned char playfield_colors[YSIZE];
+
+// Rows whose color changes along the row, only these move in color RAM.
+// The raster IRQ shifts them straight after the flip, see shift_colors.
+bool playfield_row_varied[YSIZE];
+
+unsigned char playfield_hills[PLAYFIELD_HILL_COUNT] = {0, 1, 1, 2, 3, 3, 2, 1, 0, 0, 1, 2, 2, 1, 0, 0};
+
+/* Generate a column of the map into playfield_codes and playfield_colors
+ * @param column - The map column
+ */
+void playfield_map_column(unsigned int column) {
+    static unsigned char row, top;
+
+    top = PLAYFIELD_BRICK_ROW - playfield_hills[column % PLAYFIELD_HILL_COUNT];
+
+    for(row = 0; row < PLAYFIELD_BRICK_ROW; row++) {
+        playfield_codes[row] = row < top ? SCREEN_CODE_SPACE : SCREEN_CODE_BLOCK;
+        playfield_colors[row] = COLOR_GREEN;
+    }
+
+    playfield_codes[PLAYFIELD_BRICK_ROW] = SCREEN_CODE_CHECKER;
+    playfield_colors[PLAYFIELD_BRICK_ROW] = (column & 1) ? COLOR_BROWN : COLOR_ORANGE;
+}
+
+/* Draw the first screen of the map and switch to 38 columns for scrolling
+ */
+void playfield_init(void) {
+    static unsigned char row;
+    static unsigned int offset;
+
+    for(playfield_column = 0; playfield_column < XSIZE; playfield_column++) {
+        playfield_map_column(playfield_column);
+        offset = playfield_column;
+        for(row = 0; row < YSIZE; row++) {
+            screen_front[offset] = playfield_codes[row];
+            COLOR_RAM[offset] = playfield_colors[row];
+            offset += XSIZE;
+        }
+    }
+
+    memset(playfield_row_varied, false, sizeof(playfield_row_varied));
+    playfield_row_varied[PLAYFIELD_BRICK_ROW] = true;
+
+    playfield_map_column(playfield_column);
+    playfield_phase = 0;
+    playfield_ctrl2 = (VIC.ctrl2 & ~(VIC_CTRL2_COLUMNS_40 | VIC_CTRL2_XSCROLL_MASK)) | (PLAYFIELD_PHASES - 1);
+}
+
+/* Scroll the playfield one pixel. The back buffer is rebuilt a slice of rows
+ * per frame from the front one shifted a column, so the cost is about the
+ * same every frame. The buffers flip on the last phase.
+ */
+void playfield_update(void) {
+    static unsigned char row, last_row;
+    static unsigned int offset;
+    static unsigned char* swap;
+
+    // A tick running late can come before the IRQ got to the last flip
+    if(playfield_flip) {
+        return;
+    }
+
+    if(playfield_column_pending) {
+        playfield_column++;
+        playfield_map_column(playfield_column);
+        playfield_column_pending = false;
+    }
+
+    row = playfield_phase * PLAYFIELD_SLICE_ROWS;
+    last_row = row + PLAYFIELD_SLICE_ROWS;
+    if(last_row > YSIZE) {
+        last_row = YSIZE;
+    }
+
+    offset = row * XSIZE;
+    for(; row < last_row; row++) {
+        memcpy(screen_back + offset, screen_front + offset + 1, XSIZE - 1);
+        screen_back[offset + XSIZE - 1] = playfield_codes[row];
+        offset += XSIZE;
+    }
+
+    playfield_phase++;
+    if(playfield_phase == PLAYFIELD_PHASES) {
+        playfield_phase = 0;
+
+        swap = screen_front;
+        screen_front = screen_back;
+        screen_back = swap;
+
+        playfield_flip = (unsigned int)screen_front >> 8;
+        playfield_column_pending = true;
+    }
+
+    playfield_ctrl2 = (playfield_ctrl2 & ~VIC_CTRL2_XSCROLL_MASK) | (PLAYFIELD_PHASES - 1 - playfield_phase);
+}
+
+/* The fine scroll the next frame shows, once playfield_update has run
+ */
+unsigned char playfield_next_xscroll(void) {
+    return PLAYFIELD_PHASES - 1 - (playfield_phase + 1) % PLAYFIELD_PHASES;
+}
+
+/* The screen the next frame shows, once playfield_update has run
+ */
+unsigned char* playfield_next_screen(void) {
+    return playfield_phase == PLAYFIELD_PHASES - 1 ? screen_back : screen_front;
+}
+
+#define SOFT_SPRITE_MAX 2
+// A sprite shifted into character cells covers up to 4x4 of them
+#define SOFT_SPRITE_COLUMNS 4
+#define SOFT_SPRITE_ROWS 4
+#define SOFT_SPRITE_CELLS (SOFT_SPRITE_COLUMNS * SOFT_SPRITE_ROWS)
+#define SOFT_SPRITE_LINES (SOFT_SPRITE_ROWS * SOFT_CHAR_SIZE)
+#define SOFT_SPRITE_BYTES (VIC_SPR_WIDTH / 8)
+#define SOFT_SPRITE_SHIFTS 8
+// Graphics kept pre-shifted, looked up by sprite pointer
+#define SOFT_SPRITE_CACHE 4
+#define SOFT_CHAR_SIZE 8
+// Two banks, one is shown while the other is filled
+#define SOFT_CHAR_BANKS 2
+#define SOFT_CHAR_BANK_SIZE (SOFT_SPRITE_MAX * SOFT_SPRITE_CELLS)
+// Reserve the last characters of the set for soft sprites
+#define SOFT_CHAR_FIRST (0x100 - SOFT_CHAR_BANKS * SOFT_CHAR_BANK_SIZE)
+
+/* A sprite graphic pre-shifted to each of the 8 pixel offsets in a cell
+ */
+struct soft_sprite {
+    unsigned char pointer;
+    unsigned char shifted[SOFT_SPRITE_SHIFTS][VIC_SPR_HEIGHT][SOFT_SPRITE_COLUMNS];
+};
+typedef struct soft_sprite soft_sprite;
+
+struct soft_cell {
+    unsigned int offset;
+    unsigned char code;
+    unsigned char color;
+};
+typedef struct soft_cell soft_cell;
+
+soft_sprite soft_sprites[SOFT_SPRITE_CACHE];
+unsigned char soft_sprite_cache_next = 0;
+
+// Character data and screen cells for the next soft_sprite_flush
+unsigned char soft_chars[SOFT_CHAR_BANK_SIZE * SOFT_CHAR_SIZE];
+// The bank soft_chars goes into, the other one may be on screen
+unsigned char soft_char_bank = 0;
+
+// Where soft_sprite_place put the last sprite: the top left cell, the pixel
+// offsets within it and how many cells the graphic reaches
+unsigned char soft_cell_column, soft_cell_row, soft_shift, soft_row_offset;
+unsigned char soft_columns, soft_rows;
+unsigned char soft_sprite_count = 0;
+soft_cell soft_cells[SOFT_SPRITE_MAX * SOFT_SPRITE_CELLS];
+unsigned char soft_cell_count = 0;
+
+// What was under the cells drawn by the last soft_sprite_flush
+soft_cell soft_dirty[SOFT_SPRITE_MAX * SOFT_SPRITE_CELLS];
+unsigned char* soft_dirty_screen;
+unsigned char soft_dirty_count = 0;
+
+/* Build the shifted copies of a sprite graphic. Each shift is the one
+ * before it moved a pixel, cc65 is much quicker at that than at shifting by
+ * a variable amount.
+ * @param soft - The soft sprite to fill
+ * @param sprite_pointer - The VIC sprite pointer of the graphic
+ */
+void soft_sprite_preshift(soft_sprite* soft, unsigned char sprite_pointer) {
+    static unsigned char* source;
+    static unsigned char* from;
+    static unsigned char* dest;
+    static unsigned char row;
+
+    soft->pointer = sprite_pointer;
+
+    source = (unsigned char*)(SCREEN_START + sprite_pointer * VIC_SPR_SIZE);
+    dest = soft->shifted[0][0];
+    for(row = 0; row < VIC_SPR_HEIGHT; row++) {
+        dest[0] = source[0];
+        dest[1] = source[1];
+        dest[2] = source[2];
+        dest[3] = 0;
+        source += SOFT_SPRITE_BYTES;
+        dest += SOFT_SPRITE_COLUMNS;
+    }
+
+    // The shifts follow each other in memory, so walk them as one long run
+    from = soft->shifted[0][0];
+    for(row = 0; row < (SOFT_SPRITE_SHIFTS - 1) * VIC_SPR_HEIGHT; row++) {
+        dest[0] = from[0] >> 1;
+        dest[1] = (unsigned char)(from[0] << 7) | (from[1] >> 1);
+        dest[2] = (unsigned char)(from[1] << 7) | (from[2] >> 1);
+        dest[3] = (unsigned char)(from[2] << 7) | (from[3] >> 1);
+        from += SOFT_SPRITE_COLUMNS;
+        dest += SOFT_SPRITE_COLUMNS;
+    }
+}
+
+/* Find the pre-shifted copies of a graphic, making them if they aren't
+ * cached yet
+ * @param sprite_pointer - The VIC sprite pointer of the graphic
+ * @return - The cache entry
+ */
+soft_sprite* soft_sprite_lookup(unsigned char sprite_pointer) {
+    static soft_sprite* soft;
+    static unsigned char i;
+
+    for(i = 0; i < SOFT_SPRITE_CACHE; i++) {
+        if(soft_sprites[i].pointer == sprite_pointer) {
+            return &soft_sprites[i];
+        }
+    }
+
+    soft = &soft_sprites[soft_sprite_cache_next];
+    soft_sprite_cache_next = (soft_sprite_cache_next + 1) % SOFT_SPRITE_CACHE;
+    soft_sprite_preshift(soft, sprite_pointer);
+
+    return soft;
+}
+
+/* Work out where a sprite goes in characters on the next frame's screen.
+ * Only unexpanded hires sprites over blank cells can be drawn this way.
+ * A character has one color and the sprite pixels would replace whatever
+ * the playfield has there, so the hills and the brick row are off limits.
+ * @param handle - The sprite to place
+ * @return - Whether it fits, if not it needs a VIC sprite
+ */
+bool soft_sprite_place(sprite_handle handle) {
+    static unsigned char* screen;
+    static unsigned int x, scroll_x, offset;
+    static unsigned char y, row, column, code;
+
+    if(handle->dbl || handle->multi) {
+        return false;
+    }
+
+    x = handle->lo_x;
+    if(handle->hi_x) {
+        x += 0x100;
+    }
+    y = handle->lo_y;
+
+    // The characters move with the fine scroll the next frame shows
+    scroll_x = SCREEN_SPRITE_CHAR_X_START + playfield_next_xscroll();
+
+    // Partly off the top or left, don't bother
+    if(x < scroll_x || y < SCREEN_SPRITE_CHAR_Y_START) {
+        return false;
+    }
+    x -= scroll_x;
+    y -= SCREEN_SPRITE_CHAR_Y_START;
+
+    soft_shift = x % SOFT_CHAR_SIZE;
+    soft_row_offset = y % SOFT_CHAR_SIZE;
+    soft_cell_column = x / SOFT_CHAR_SIZE;
+    soft_cell_row = y / SOFT_CHAR_SIZE;
+
+    // Only the cells the graphic reaches
+    soft_columns = soft_shift ? SOFT_SPRITE_COLUMNS : SOFT_SPRITE_COLUMNS - 1;
+    soft_rows = (soft_row_offset + VIC_SPR_HEIGHT + SOFT_CHAR_SIZE - 1) / SOFT_CHAR_SIZE;
+
+    screen = playfield_next_screen();
+    for(row = 0; row < soft_rows && soft_cell_row + row < YSIZE; row++) {
+        offset = (soft_cell_row + row) * XSIZE + soft_cell_column;
+        for(column = 0; column < soft_columns && soft_cell_column + column < XSIZE; column++) {
+            // A soft cell from the last frame has a blank cell under it
+            code = screen[offset + column];
+            if(code != SCREEN_CODE_SPACE && code < SOFT_CHAR_FIRST) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+/* Render a sprite into the next free set of soft characters, in the
+ * sprite's color. The characters go column by column, so each column of the
+ * graphic is one run.
+ * @param handle - The sprite to draw, soft_sprite_place must accept it
+ */
+void soft_sprite_stage(sprite_handle handle) {
+    static soft_sprite* soft;
+    static soft_cell* cell;
+    static unsigned char* source;
+    static unsigned char* dest;
+    static unsigned char code, row, line, column;
+
+    soft_sprite_place(handle);
+    soft = soft_sprite_lookup(handle->pointer);
+
+    dest = soft_chars + soft_sprite_count * SOFT_SPRITE_CELLS * SOFT_CHAR_SIZE;
+    code = SOFT_CHAR_FIRST + soft_char_bank * SOFT_CHAR_BANK_SIZE + soft_sprite_count * SOFT_SPRITE_CELLS;
+    soft_sprite_count++;
+
+    for(column = 0; column < SOFT_SPRITE_COLUMNS; column++) {
+        memset(dest, 0, soft_row_offset);
+        dest += soft_row_offset;
+
+        source = &soft->shifted[soft_shift][0][column];
+        for(line = 0; line < VIC_SPR_HEIGHT; line++) {
+            *dest = *source;
+            dest++;
+            source += SOFT_SPRITE_COLUMNS;
+        }
+
+        memset(dest, 0, SOFT_SPRITE_LINES - VIC_SPR_HEIGHT - soft_row_offset);
+        dest += SOFT_SPRITE_LINES - VIC_SPR_HEIGHT - soft_row_offset;
+
+        if(column >= soft_columns || soft_cell_column + column >= XSIZE) {
+            code += SOFT_SPRITE_ROWS;
+            continue;
+        }
+
+        for(row = 0; row < SOFT_SPRITE_ROWS; row++) {
+            if(row < soft_rows && soft_cell_row + row < YSIZE) {
+                cell = &soft_cells[soft_cell_count];
+                cell->offset = (soft_cell_row + row) * XSIZE + soft_cell_column + column;
+                cell->code = code;
+                cell->color = handle->color;
+                soft_cell_count++;
+            }
+            code++;
+        }
+    }
+}
+
+/* Decide which sprites the multiplexer can show. A sprite that would take
+ * a VIC sprite still in use by the one 8 places before it is drawn in
+ * software instead. If it can't be, the closest sprite before it that can
+ * goes soft instead and the list is gone through again. Then the
+ * enable/expand masks are renumbered to match the VIC sprites the IRQ will
+ * hand out. The IRQ goes by the new soft flags right away, so call
+ * soft_sprite_flush soon after.
+ */
+void update_sprite_budget(void) {
+    static unsigned int slot_bottom[VIC_SPR_COUNT];
+    static bool soft_wanted[SPRITE_POOL_SIZE];
+    static sprite_handle handle;
+    static unsigned char i, j, rank, slot, hi_mask, demoted, looked;
+    static bool retry;
+
+    memset(soft_wanted, false, sizeof(soft_wanted));
+    demoted = 0;
+
+    do {
+        retry = false;
+        rank = 0;
+        for(i = 0; i < sprite_count; i++) {
+            if(soft_wanted[i]) {
+                continue;
+            }
+
+            handle = _sprite_list[i];
+            slot = rank % VIC_SPR_COUNT;
+
+            if(rank >= VIC_SPR_COUNT
+                && handle->lo_y < slot_bottom[slot]
+                && demoted < SOFT_SPRITE_MAX) {
+                if(soft_sprite_place(handle)) {
+                    soft_wanted[i] = true;
+                    demoted++;
+                    continue;
+                }
+
+                // Only the VIC sprites' last 8 users can make room
+                looked = 0;
+                for(j = i; j > 0 && looked < VIC_SPR_COUNT;) {
+                    j--;
+                    if(soft_wanted[j]) {
+                        continue;
+                    }
+                    looked++;
+
+                    if(soft_sprite_place(_sprite_list[j])) {
+                        soft_wanted[j] = true;
+                        demoted++;
+                        retry = true;
+                        break;
+                    }
+                }
+
+                if(retry) {
+                    break;
+                }
+            }
+
+            slot_bottom[slot] = handle->lo_y + VIC_SPR_HEIGHT;
+            if(handle->dbl) {
+                slot_bottom[slot] += VIC_SPR_HEIGHT;
+            }
+
+            rank++;
+        }
+    } while(retry);
+
+    soft_sprite_count = 0;
+    soft_cell_count = 0;
+
+    rank = 0;
+    for(i = 0; i < sprite_count; i++) {
+        handle = _sprite_list[i];
+
+        if(soft_wanted[i]) {
+            soft_sprite_stage(handle);
+            handle->soft = true;
+            continue;
+        }
+
+        handle->soft = false;
+
+        hi_mask = 1<<(rank % VIC_SPR_COUNT);
+        handle->ena = hi_mask;
+        if(handle->hi_x) {
+            handle->hi_x = hi_mask;
+        }
+        if(handle->dbl) {
+            handle->dbl = hi_mask;
+        }
+        if(handle->multi) {
+            handle->multi = hi_mask;
+        }
+
+        rank++;
+    }
+}
+
+/* Take down the soft sprites drawn by the last soft_sprite_flush. Call
+ * before playfield_update. If their screen is about to be flipped out, the
+ * cells stay so the sprites show until the flip, the playfield rebuilds
+ * that screen before it's shown again. Color RAM is shared, so it's always
+ * put back.
+ */
+void soft_sprite_restore(void) {
+    static soft_cell* dirty;
+    static unsigned char i;
+    static bool leaving;
+
+    leaving = soft_dirty_screen != playfield_next_screen();
+
+    // Backwards, in case two soft sprites touched the same cell
+    for(i = soft_dirty_count; i > 0; i--) {
+        dirty = &soft_dirty[i - 1];
+        if(!leaving) {
+            soft_dirty_screen[dirty->offset] = dirty->code;
+        }
+        COLOR_RAM[dirty->offset] = dirty->color;
+    }
+    soft_dirty_count = 0;
+}
+
+/* Copy the characters staged by update_sprite_budget into their bank. The
+ * bank isn't on screen, so the soft sprites showing now stay intact.
+ */
+void soft_sprite_upload(void) {
+    static unsigned char* dest;
+    static unsigned char* source;
+    static unsigned char i;
+
+    dest = (unsigned char*)(CHARACTER_START + (SOFT_CHAR_FIRST + soft_char_bank * SOFT_CHAR_BANK_SIZE) * SOFT_CHAR_SIZE);
+    source = soft_chars;
+    for(i = 0; i < soft_sprite_count * SOFT_SPRITE_CELLS; i++) {
+        // The character set is under the IO area. One character at a time,
+        // so the multiplexer's IRQs are never held off for more than a few
+        // raster lines.
+        SEI();
+        hide_io();
+        memcpy(dest, source, SOFT_CHAR_SIZE);
+        show_io();
+        CLI();
+
+        dest += SOFT_CHAR_SIZE;
+        source += SOFT_CHAR_SIZE;
+    }
+}
+
+/* Put the soft sprites uploaded by soft_sprite_upload on the screen the
+ * next frame shows. Call after playfield_update, which makes it the front.
+ */
+void soft_sprite_flush(void) {
+    static soft_cell* cell;
+    static soft_cell* dirty;
+    static unsigned char i;
+
+    if(!soft_sprite_count) {
+        return;
+    }
+
+    soft_dirty_screen = screen_front;
+    for(i = 0; i < soft_cell_count; i++) {
+        cell = &soft_cells[i];
+        dirty = &soft_dirty[i];
+
+        dirty->offset = cell->offset;
+        dirty->code = screen_front[cell->offset];
+        dirty->color = COLOR_RAM[cell->offset] & 0x0F;
+
+        screen_front[cell->offset] = cell->code;
+        COLOR_RAM[cell->offset] = cell->color;
+    }
+    soft_dirty_count = soft_cell_count;
+
+    // Stage the next ones into the bank that isn't on screen
+    soft_char_bank ^= 1;
+}
+
+#define INPUT_LOG_SIZE 256
+#define INPUT_FILENAME "input.rec"
+#define INPUT_LFN 2
+#define INPUT_SA 2
+// cbm_save writes the load address first
+#define INPUT_HEADER_SIZE 2
+
+#define INPUT_MODE_LIVE 0
+#define INPUT_MODE_RECORD 1
+#define INPUT_MODE_REPLAY 2
+
+#define INPUT_ENTRY_MAX_FRAMES 0xff
+
+/* A run of frames with the same joystick state
+ */
+struct input_entry {
+    unsigned char frames;
+    unsigned char joy1;
+    unsigned char joy2;
+};
+typedef struct input_entry input_entry;
+
+input_entry input_log[INPUT_LOG_SIZE];
+unsigned int input_log_length = 0;
+unsigned char input_mode = INPUT_MODE_LIVE;
+
+// Joystick state for the current frame, bits are high when pressed
+unsigned char input_joy1 = 0;
+unsigned char input_joy2 = 0;
+
+/* Pick the input mode. With RECORD_INPUT defined every frame's joystick state
+ * is logged. With REPLAY_INPUT defined INPUT_FILENAME is replayed, anything
+ * past the size of input_log is ignored. Otherwise the disk isn't touched.
+ */
+void input_init(void) {
+#ifdef REPLAY_INPUT
+    static unsigned char header[INPUT_HEADER_SIZE];
+    static int loaded;
+#endif
+
+    input_log_length = 0;
+
+#if defined(RECORD_INPUT)
+    input_mode = INPUT_MODE_RECORD;
+#elif defined(REPLAY_INPUT)
+    if(cbm_open(INPUT_LFN, disk_device(), INPUT_SA, INPUT_FILENAME)) {
+        cbm_close(INPUT_LFN);
+        return;
+    }
+
+    loaded = 0;
+    if(cbm_read(INPUT_LFN, header, INPUT_HEADER_SIZE) == INPUT_HEADER_SIZE) {
+        loaded = cbm_read(INPUT_LFN, input_log, sizeof(input_log));
+    }
+    cbm_close(INPUT_LFN);
+
+    if(loaded >= (int)sizeof(input_entry)) {
+        input_log_length = loaded / sizeof(input_entry);
+        input_mode = INPUT_MODE_REPLAY;
+    }
+#endif
+}
+
+/* Write the recorded input to INPUT_FILENAME and go back to live input
+ */
+void input_save(void) {
+    input_mode = INPUT_MODE_LIVE;
+    cbm_save(INPUT_FILENAME, disk_device(), input_log, input_log_length * sizeof(input_entry));
+}
+
+/* Update input_joy1 and input_joy2 for the next frame.
+ * Call once per game_clock tick so recordings line up with the game logic.
+ * When recording, RUN/STOP or a full log saves the recording.
+ */
+void input_update(void) {
+    static unsigned int index;
+    static unsigned char frames_left;
+    static input_entry* entry;
+    static unsigned char joy1, joy2;
+
+    if(input_mode == INPUT_MODE_REPLAY) {
+        if(!frames_left) {
+            if(index == input_log_length) {
+                input_mode = INPUT_MODE_LIVE;
+                return;
+            }
+
+            entry = &input_log[index];
+            index++;
+            frames_left = entry->frames;
+            input_joy1 = entry->joy1;
+            input_joy2 = entry->joy2;
+        }
+
+        frames_left--;
+        return;
+    }
+
+    joy1 = ~*(unsigned char *)CIA1_JOY1 & CIA1_JOY_MASK;
+    joy2 = ~*(unsigned char *)CIA1_JOY2 & CIA1_JOY_MASK;
+
+    input_joy1 = joy1;
+    input_joy2 = joy2;
+
+    if(input_mode != INPUT_MODE_RECORD) {
+        return;
+    }
+
+    if(!(*(unsigned char *)STKEY & STKEY_RUN_STOP)) {
+        input_save();
+        return;
+    }
+
+    if(input_log_length) {
+        entry = &input_log[input_log_length - 1];
+        if(entry->frames != INPUT_ENTRY_MAX_FRAMES
+            && entry->joy1 == joy1
+            && entry->joy2 == joy2) {
+            entry->frames++;
+            return;
+        }
+    }
+
+    if(input_log_length == INPUT_LOG_SIZE) {
+        input_save();
+        return;
+    }
+
+    entry = &input_log[input_log_length];
+    entry->frames = 1;
+    entry->joy1 = joy1;
+    entry->joy2 = joy2;
+    input_log_length++;
+}
+
 #define WAW_SPRITE_COUNT 9
 #define WAW_SPRITE_OFFSET 0
 #define WAW_COLUMNS 3
@@ -470,8 +1213,57 @@ void update_waw(register waw* waw) {
     }
 }
 
+#define SWARM_COUNT 4
+#define SWARM_SPRITE_OFFSET 4
+// Across the rows both waws always cover, above the hills
+#define SWARM_Y 150
+#define SWARM_SPACING 32
+#define SWARM_SPEED 1
+// Off the right edge and back in, keeping the spacing
+#define SWARM_WRAP (SWARM_SPACING * 12)
+
+/* A row of unexpanded sprites flying left through the waws. With the waws
+ * that's more sprites on the same lines than the VIC has, so some of them
+ * get drawn into characters.
+ */
+struct swarm {
+    unsigned int x[SWARM_COUNT];
+    sprite_handle sprites[SWARM_COUNT];
+};
+typedef struct swarm swarm;
+
+void init_swarm(register swarm* swarm) {
+    static unsigned char i;
+    static sprite_handle sprite;
+
+    for(i = 0; i < SWARM_COUNT; i++) {
+        sprite = new_sprite(false);
+        set_sprite_graphic(sprite, SWARM_SPRITE_OFFSET);
+        swarm->x[i] = SCREEN_SPRITE_BORDER_X_START + VIC_SPR_WIDTH * 4 + i * SWARM_SPACING;
+        set_sprite_x(sprite, swarm->x[i]);
+        set_sprite_y(sprite, SWARM_Y);
+        swarm->sprites[i] = sprite;
+    }
+}
+
+void update_swarm(register swarm* swarm) {
+    static unsigned char i;
+    static unsigned int x;
+
+    for(i = 0; i < SWARM_COUNT; i++) {
+        x = swarm->x[i];
+        if(x < SWARM_SPEED) {
+            x += SWARM_WRAP;
+        }
+        x -= SWARM_SPEED;
+        swarm->x[i] = x;
+        set_sprite_x(swarm->sprites[i], x);
+    }
+}
+
 unsigned char main(void) {
     static unsigned char err;
+    static swarm swarm;
     static waw waw2 = {VIC_SPR_WIDTH * WAW_COLUMNS * 2,VIC_SPR_HEIGHT * 2,0,true,true};
     static waw waw = {0,0,0,true,true};
 
@@ -479,25 +1271,46 @@ unsigned char main(void) {
     is_pal = get_tv();
 
     if(err = spritesheet_load("sprites.spd")) {
+#ifdef LEAN
+        kernal_puts("Spritesheet failed to load");
+#else
         printf("Spritesheet failed to load: %d", errno);
+#endif
         return EXIT_FAILURE;
     }
 
+    input_init();
+
     init_sprite_pool();
     init_waw(&waw);
     init_waw(&waw2);
+    init_swarm(&swarm);
 
     character_init(true);
     setup_irq_handler();
     screen_init(true);
+    playfield_init();
 
     do {
         if(last_updated == game_clock) {
             continue;
         }
 
+        input_update();
+
         update_waw(&waw);
         update_waw(&waw2);
+        update_swarm(&swarm);
+
+        // Soft sprites are placed for the scroll and screen of the next frame
+        update_sprite_budget();
+        soft_sprite_upload();
+
+        // Soft sprites come off before the playfield copies the screen, and
+        // go back on right after, so a newly demoted sprite is hardly missed
+        soft_sprite_restore();
+        playfield_update();
+        soft_sprite_flush();
 
         last_updated++;
     } while(true);
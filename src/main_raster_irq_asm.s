@@ -1,19 +1,32 @@
 .macpack longbranch
 .import __sprite_list, _irq_setup_done, _is_pal, _game_clock, _sprite_count, _main_raster_irq
+.import _playfield_flip, _playfield_ctrl2, _playfield_row_varied, _playfield_colors
 .importzp ptr1
 .include "c64.inc"
 .interruptor raster_irq, 2
 
+.ifdef REGRESS
+.export _regress_frame, _regress_shown
+.endif
+
 .define IRQ_NOT_HANDLED #$00
 .define IRQ_HANDLED #$01
 
 .define VIC_IRQ_RASTER #$01
 
-; FIXME
-.define SPR_POINTERS $C000+$3F8
+; Sprite pointers of the screen shown at startup, SCREEN_START comes from
+; SConstruct. flip_screen moves the stores below along to whichever screen is
+; active.
+.define SPR_POINTERS SCREEN_START+$3F8
+.define SPR_POINTERS_OFFSET $3F8
+
+.define SCREEN_COLUMNS 40
+.define SCREEN_ROWS 25
 
 .define VIC_SPR_COUNT #$8
 .define VIC_SPR_HEIGHT #$21
+; Raster lines an unexpanded sprite covers
+.define VIC_SPR_LINES #21
 
 
 ; ARG A = sprite index
@@ -51,6 +64,16 @@ current_y:      .byte $00
 new_y:          .byte $00
 hi_mask:        .byte $00
 raster_clock:   .byte $06
+screen_hi:      .byte $00
+
+.ifdef REGRESS
+; Sprites placed before the beam reached them this frame
+_regress_shown:         .byte $00
+; The first batch is placed for the next frame, so it's never late
+regress_first_batch:    .byte $00
+; Line after the last one of the sprite each VIC sprite was given this frame
+regress_slot_bottom:    .res 8
+.endif
 
 .segment "CODE"
 
@@ -63,6 +86,10 @@ raster_clock:   .byte $06
     sta sprite_index
     sta vic_sprite
 
+.ifdef REGRESS
+    jsr _regress_frame
+.endif
+
     ; If we're PAL, the game clock is already 50hz
     ldx _is_pal
     bne update_game_clock
@@ -76,11 +103,21 @@ raster_clock:   .byte $06
     stx raster_clock
     jmp sprite_index_updated
 update_game_clock:
+    ; Scroll the playfield in step with the game clock
+    lda _playfield_flip
+    beq playfield_flipped
+    jsr flip_screen
+    jsr shift_colors
+playfield_flipped:
+    lda _playfield_ctrl2
+    sta VIC_CTRL2
+
     inc _game_clock
     bne sprite_index_updated
     inc _game_clock+1
 sprite_index_updated:
-
+    ; The frame start code may have used A
+    lda sprite_index
     get_next_sprite
 
 sprite_update_loop:
@@ -88,6 +125,40 @@ sprite_update_loop:
     lda new_y
     sta current_y
 
+.ifdef REGRESS
+    ; If the VIC sprite is still drawing the sprite 8 places back, the VIC
+    ; never starts this one
+    ldx vic_sprite
+    cmp regress_slot_bottom,X
+    bcc sprite_late
+
+    ; If the beam is already past the top of the sprite it's dropped or torn
+    lda regress_first_batch
+    bne sprite_on_time
+    lda VIC_CTRL1
+    bmi sprite_late
+    lda VIC_HLINE
+    cmp current_y
+    bcs sprite_late
+sprite_on_time:
+    inc _regress_shown
+sprite_late:
+
+    ; Remember where this sprite ends for the next one on the VIC sprite
+    ldy #$06 ; FIXME offsetof(dbl)
+    lda (ptr1),Y
+    beq regress_unexpanded
+    lda VIC_SPR_LINES
+regress_unexpanded:
+    clc
+    adc VIC_SPR_LINES
+    adc current_y
+    bcc regress_bottom
+    lda #$ff
+regress_bottom:
+    sta regress_slot_bottom,X
+.endif
+
     ; prep the pointer for struct access
     ldy #$00 ; FIXME offsetof(color)
 
@@ -99,6 +170,7 @@ sprite_update_loop:
 
     iny
     lda (ptr1),y
+spr_pointer_store:
     sta SPR_POINTERS,X
 
     ; inc vic_sprite for next loop
@@ -144,6 +216,7 @@ write_vic_sprite:
     iny
     himasker VIC_SPR_MCOLOR
 
+next_sprite:
     ; inc sprite_index
     ldx sprite_index
     inx
@@ -161,6 +234,19 @@ moarcs:
     sta sprite_index
 
     get_next_sprite
+
+    ; Sprites drawn into the character set don't get a VIC sprite. Skip them
+    ; here so they never end a batch, that way the sprite the next IRQ starts
+    ; with has been checked already. Sprite 0 is never soft.
+    ldy #$08 ; FIXME offsetof(soft)
+    lda (ptr1),Y
+    beq hardware_sprite
+.ifdef REGRESS
+    inc _regress_shown
+.endif
+    jmp next_sprite
+hardware_sprite:
+
     ; if new_y >= current_y + buffer
     lda current_y
     clc
@@ -169,6 +255,11 @@ moarcs:
     jcs sprite_update_loop
 end_sprite_update_loop:
 
+.ifdef REGRESS
+    lda #$00
+    sta regress_first_batch
+.endif
+
 handled:
     lda IRQ_HANDLED
     rts
@@ -178,6 +269,104 @@ unhandled:
     rts
 .endproc
 
+; ARG A = high byte of the screen to show
+; Points the VIC and the IRQ's sprite pointer store at the new screen, and
+; carries over the pointers of the sprites that are already set up
+.proc flip_screen
+    sta screen_hi
+
+    clc
+    adc #>SPR_POINTERS_OFFSET
+    ldx main_raster_irq::spr_pointer_store+2
+    stx copy_load+2
+    sta copy_store+2
+    sta main_raster_irq::spr_pointer_store+2
+
+    ldx #$07
+copy_load:
+    lda SPR_POINTERS,X
+copy_store:
+    sta SPR_POINTERS,X
+    dex
+    bpl copy_load
+
+    ; The screen bits of $D018 are the 1k block within the VIC bank
+    lda screen_hi
+    and #$3c
+    asl
+    asl
+    sta screen_hi
+    lda VIC_VIDEO_ADR
+    and #$0f
+    ora screen_hi
+    sta VIC_VIDEO_ADR
+
+    lda #$00
+    sta _playfield_flip
+    rts
+.endproc
+
+; Shifts the color RAM rows flagged in _playfield_row_varied a column left
+; and brings in _playfield_colors as the new column. Color RAM can't be
+; double buffered, so this runs straight after the flip, in the border, and
+; is done long before the beam gets to the first row.
+.proc shift_colors
+    lda #<COLOR_RAM
+    sta ptr1
+    lda #>COLOR_RAM
+    sta ptr1+1
+
+    ldx #$00
+row_loop:
+    lda _playfield_row_varied,X
+    beq next_row
+
+    ldy #$01
+column_loop:
+    lda (ptr1),Y
+    dey
+    sta (ptr1),Y
+    iny
+    iny
+    cpy #SCREEN_COLUMNS
+    bne column_loop
+
+    dey
+    lda _playfield_colors,X
+    sta (ptr1),Y
+
+next_row:
+    lda ptr1
+    clc
+    adc #SCREEN_COLUMNS
+    sta ptr1
+    bcc no_carry
+    inc ptr1+1
+no_carry:
+    inx
+    cpx #SCREEN_ROWS
+    bne row_loop
+    rts
+.endproc
+
+.ifdef REGRESS
+; Called at the start of each frame. The test harness puts a checkpoint here
+; and reads _regress_shown for the frame that just ended.
+.proc _regress_frame
+    lda #$00
+    sta _regress_shown
+    ldx #$07
+clear_slots:
+    sta regress_slot_bottom,X
+    dex
+    bpl clear_slots
+
+    lda #$01
+    sta regress_first_batch
+    rts
+.endproc
+.endif
+
 .proc raster_irq
     ; Make sure this is a raster interrupt and we're ready
     lda VIC_IRQ_RASTER
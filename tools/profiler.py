@@ -0,0 +1,270 @@
+"""Cycle attributed profiler for msprite.
+
+  profiler.py capture  runs the disk image in VICE and single steps it through
+                      the binary monitor, writing a trace
+  profiler.py report   attributes the cycles in a trace to C functions, asm
+                      procs and cc65 runtime helpers
+
+Traces are text, one executed instruction per line:
+
+  .C:080d  <anything>  <CPU clock>
+
+which is what both the capture and VICE's "chis" monitor command produce.
+The cycles of an instruction are the difference to the next line's clock, or
+one sample per line with --samples for PC histories without a clock. JSR,
+RTS and RTI in a line are used to rebuild the call stack.
+
+The report is a flat profile plus a collapsed stack file for flamegraph.pl.
+"""
+import argparse
+import bisect
+import re
+import sys
+from collections import defaultdict
+
+from vice import Vice, MODELS, RESPONSE_CHECKPOINT_INFO, read_labels
+
+IRQ_ENTRY = 0xff48
+NMI_ENTRY = 0xfe43
+IRQ_FRAME = '[irq]'
+
+OPCODE_MNEMONICS = {
+    0x00: 'BRK',
+    0x20: 'JSR',
+    0x40: 'RTI',
+    0x60: 'RTS',
+}
+
+
+def parse_debug_info(line):
+    kind, _, fields = line.rstrip('\n').partition('\t')
+    values = {}
+    for key, value in re.findall(r'(\w+)=("[^"]*"|[^,]*)', fields):
+        values[key] = value.strip('"')
+    return kind, values
+
+
+class Symbols(object):
+    """Maps addresses to C functions and asm procs from the ld65 debug file,
+    and to the other exported labels (the cc65 runtime) from the map file."""
+
+    def __init__(self, debug_path, map_path):
+        syms = {}
+        c_names = {}
+        scopes = []
+        with open(debug_path) as debug_file:
+            for line in debug_file:
+                kind, values = parse_debug_info(line)
+                if kind == 'sym' and 'val' in values:
+                    syms[values['id']] = (values['name'], int(values['val'], 16))
+                elif kind == 'csym' and 'sym' in values:
+                    c_names[values['sym']] = values['name']
+                elif kind == 'scope' and values.get('type') == 'scope' and 'sym' in values and values.get('name'):
+                    scopes.append((values['sym'], int(values.get('size', '0'))))
+
+        # Innermost scope wins, so put the small ones first
+        self.scopes = []
+        for sym_id, size in scopes:
+            if sym_id not in syms or not size:
+                continue
+            name, start = syms[sym_id]
+            self.scopes.append((start, start + size, c_names.get(sym_id, name)))
+        self.scopes.sort(key=lambda scope: scope[1] - scope[0])
+
+        exports = {}
+        with open(map_path) as map_file:
+            text = map_file.read()
+            exports_list = text.split('Exports list by name:')[1].split('Exports list by value:')[0]
+            # Only labels. Equates like __CODE_SIZE__ can have values inside the code.
+            for name, address, kind in re.findall(r'(\S+)\s+([0-9A-F]{6}) [R ]([LE])', exports_list):
+                if kind == 'L':
+                    exports[int(address, 16)] = name
+            segments = text.split('Segment list:')[1].split('Exports list')[0]
+            ranges = [(int(start, 16), int(end, 16)) for name, start, end in re.findall(r'^(\w+)\s+([0-9A-F]{6})\s+([0-9A-F]{6})\s', segments, re.MULTILINE) if name != 'ZEROPAGE']
+        self.program_start = min(start for start, end in ranges)
+        self.program_end = max(end for start, end in ranges)
+        self.export_addresses = sorted(exports)
+        self.exports = exports
+        self.cache = {}
+
+    def name(self, pc):
+        if pc in self.cache:
+            return self.cache[pc]
+
+        name = None
+        for start, end, scope_name in self.scopes:
+            if start <= pc < end:
+                name = scope_name
+                break
+
+        if name is None:
+            if pc >= 0xe000:
+                name = '[kernal]'
+            elif 0xa000 <= pc < 0xc000 and pc > self.program_end:
+                name = '[basic]'
+            elif self.program_start <= pc <= self.program_end:
+                index = bisect.bisect_right(self.export_addresses, pc) - 1
+                name = self.exports[self.export_addresses[index]] if index >= 0 else '[unknown]'
+            else:
+                name = '[unknown]'
+
+        self.cache[pc] = name
+        return name
+
+
+def read_trace(path, samples):
+    """Yields (pc, mnemonic, clock) per traced instruction"""
+    pattern = re.compile(r'^\.C:([0-9a-fA-F]{4})\s*(.*?)(?:\s+(\d+))?\s*$')
+    with open(path) as trace:
+        for line in trace:
+            match = pattern.match(line)
+            if not match:
+                continue
+            rest = match.group(2)
+            clock = match.group(3)
+            if samples or clock is None:
+                rest = rest + ' ' + (clock or '')
+                clock = None
+            mnemonic = re.search(r'\b(JSR|RTS|RTI)\b', rest, re.IGNORECASE)
+            yield int(match.group(1), 16), mnemonic.group(1).upper() if mnemonic else None, int(clock) if clock else None
+
+
+def attribute(symbols, trace):
+    """Returns {collapsed stack: cycles}"""
+    stacks = defaultdict(int)
+    stack = []
+    previous = None
+
+    for entry in trace:
+        if previous is not None:
+            pc, mnemonic, clock = previous
+            cycles = entry[2] - clock if clock is not None and entry[2] is not None else 1
+            stacks[';'.join(stack + [symbols.name(pc)])] += cycles
+
+            if mnemonic == 'JSR':
+                stack.append(symbols.name(pc))
+            elif mnemonic == 'RTS':
+                if stack and stack[-1] != IRQ_FRAME:
+                    stack.pop()
+            elif mnemonic == 'RTI':
+                while stack and stack.pop() != IRQ_FRAME:
+                    pass
+                if stack:
+                    stack.pop()
+
+            # Interrupts come in without a JSR
+            if entry[0] in (IRQ_ENTRY, NMI_ENTRY) and mnemonic != 'JSR':
+                stack.append(symbols.name(pc))
+                stack.append(IRQ_FRAME)
+
+        previous = entry
+
+    return stacks
+
+
+def report(args):
+    symbols = Symbols(args.debug, args.map)
+    stacks = attribute(symbols, read_trace(args.trace, args.samples))
+
+    self_cycles = defaultdict(int)
+    total_cycles = defaultdict(int)
+    for stack, cycles in stacks.items():
+        frames = stack.split(';')
+        self_cycles[frames[-1]] += cycles
+        for frame in set(frames):
+            total_cycles[frame] += cycles
+
+    total = sum(stacks.values()) or 1
+    unit = 'samples' if args.samples else 'cycles'
+
+    lines = ['%10s %6s %10s %6s  %s' % ('self', '%', 'total', '%', 'symbol')]
+    for name, cycles in sorted(self_cycles.items(), key=lambda item: -item[1]):
+        lines.append('%10d %5.1f%% %10d %5.1f%%  %s' % (cycles, 100.0 * cycles / total, total_cycles[name], 100.0 * total_cycles[name] / total, name))
+    lines.append('%d %s total' % (total, unit))
+
+    flat = '\n'.join(lines) + '\n'
+    sys.stdout.write(flat)
+    if args.flat:
+        with open(args.flat, 'w') as flat_file:
+            flat_file.write(flat)
+
+    if args.collapsed:
+        with open(args.collapsed, 'w') as collapsed:
+            for stack, cycles in sorted(stacks.items()):
+                collapsed.write('%s %d\n' % (stack, cycles))
+
+    return 0
+
+
+def capture(args):
+    labels = read_labels(args.labels)
+    cycles_per_line, lines_per_frame = MODELS[args.model]
+    cycles_per_frame = cycles_per_line * lines_per_frame
+
+    opcodes = {}
+    vice = Vice(args.disk, model=args.model)
+    try:
+        vice.checkpoint(labels[args.start], temporary=True)
+        vice.resume()
+        vice.wait_event(RESPONSE_CHECKPOINT_INFO)
+
+        registers = vice.registers()
+        if 'LIN' not in registers or 'CYC' not in registers:
+            raise SystemExit('This VICE does not report the raster position, use a trace from chis instead')
+
+        clock = 0
+        last_position = None
+        with open(args.trace, 'w') as trace:
+            for i in range(args.instructions):
+                pc = registers['PC']
+                position = registers['LIN'] * cycles_per_line + registers['CYC']
+                if last_position is not None:
+                    clock += (position - last_position) % cycles_per_frame
+                last_position = position
+
+                # Code doesn't move, so each opcode only has to be read once
+                if pc not in opcodes:
+                    opcodes[pc] = vice.memory(pc, 1)[0]
+                opcode = opcodes[pc]
+
+                trace.write('.C:%04x  %02X  %s  %d\n' % (pc, opcode, OPCODE_MNEMONICS.get(opcode, '---'), clock))
+
+                vice.step()
+                registers = vice.last_registers or vice.registers()
+    finally:
+        vice.close()
+
+    return 0
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    commands = parser.add_subparsers(dest='command')
+
+    capture_parser = commands.add_parser('capture', help='trace a headless run')
+    capture_parser.add_argument('--disk', required=True, help='disk image to run')
+    capture_parser.add_argument('--labels', required=True, help='VICE label file of the build')
+    capture_parser.add_argument('--trace', required=True, help='trace file to write')
+    capture_parser.add_argument('--start', default='_update_waw', help='label to start tracing at')
+    capture_parser.add_argument('--instructions', type=int, default=50000, help='instructions to trace')
+    capture_parser.add_argument('--model', default='ntsc', choices=sorted(MODELS))
+
+    report_parser = commands.add_parser('report', help='profile a trace')
+    report_parser.add_argument('--debug', required=True, help='ld65 debug file')
+    report_parser.add_argument('--map', required=True, help='ld65 map file')
+    report_parser.add_argument('--trace', required=True, help='trace file to read')
+    report_parser.add_argument('--samples', action='store_true', help='lines are PC samples without a clock')
+    report_parser.add_argument('--flat', help='also write the flat profile here')
+    report_parser.add_argument('--collapsed', help='write flamegraph collapsed stacks here')
+
+    args = parser.parse_args()
+    if args.command == 'capture':
+        return capture(args)
+    if args.command == 'report':
+        return report(args)
+    parser.print_help()
+    return 1
+
+
+if __name__ == '__main__':
+    sys.exit(main())
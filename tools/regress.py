@@ -0,0 +1,193 @@
+"""Headless visual regression and dropped sprite check.
+
+Boots the regression build (scons test) in VICE, stops at the start of every
+frame via _regress_frame and:
+
+ * compares the screen at a few fixed frames to the golden images
+ * checks that every virtual sprite made it on screen, using the
+   _regress_shown counter kept by the raster IRQ. A sprite counts as shown
+   if its VIC sprite was done with the sprite before it and the beam hadn't
+   reached it yet.
+
+Frames are counted from the first multiplexed frame. The goldens depend on
+the VICE version and the model, so regenerate them with
+scons test update_golden=1 when either changes. A missing golden is a failure
+unless --allow-missing is given (scons test allow_missing_golden=1), which
+only runs the sprite check for those frames.
+"""
+import argparse
+import os
+import struct
+import sys
+import zlib
+
+from vice import Vice, RESPONSE_CHECKPOINT_INFO, read_labels
+
+# Pepto's palette, so the goldens are viewable
+PALETTE = [
+    0x000000, 0xffffff, 0x68372b, 0x70a4b2, 0x6f3d86, 0x588d43, 0x352879, 0xb8c76f,
+    0x6f4f25, 0x433900, 0x9a6759, 0x444444, 0x6c6c6c, 0x9ad284, 0x6c5eb5, 0x959595,
+]
+
+
+def png_chunk(chunk_type, data):
+    chunk = chunk_type + data
+    return struct.pack('>I', len(data)) + chunk + struct.pack('>I', zlib.crc32(chunk) & 0xffffffff)
+
+
+def write_png(path, width, height, pixels):
+    """Writes 8 bit palette indices as an indexed PNG"""
+    palette = b''.join(struct.pack('>I', color)[1:] for color in PALETTE)
+    rows = b''.join(b'\0' + bytes(pixels[y * width:(y + 1) * width]) for y in range(height))
+    with open(path, 'wb') as png:
+        png.write(b'\x89PNG\r\n\x1a\n')
+        png.write(png_chunk(b'IHDR', struct.pack('>IIBBBBB', width, height, 8, 3, 0, 0, 0)))
+        png.write(png_chunk(b'PLTE', palette))
+        png.write(png_chunk(b'IDAT', zlib.compress(rows, 9)))
+        png.write(png_chunk(b'IEND', b''))
+
+
+def paeth(a, b, c):
+    p = a + b - c
+    pa, pb, pc = abs(p - a), abs(p - b), abs(p - c)
+    if pa <= pb and pa <= pc:
+        return a
+    if pb <= pc:
+        return b
+    return c
+
+
+def read_png(path):
+    """Reads an 8 bit indexed PNG as written by write_png"""
+    with open(path, 'rb') as png:
+        data = png.read()
+
+    offset = 8
+    idat = b''
+    while offset < len(data):
+        length, chunk_type = struct.unpack_from('>I4s', data, offset)
+        chunk = data[offset + 8:offset + 8 + length]
+        if chunk_type == b'IHDR':
+            width, height, depth, color_type = struct.unpack_from('>IIBB', chunk)
+            if depth != 8 or color_type != 3:
+                raise ValueError('%s is not an 8 bit indexed PNG' % path)
+        elif chunk_type == b'IDAT':
+            idat += chunk
+        offset += 12 + length
+
+    raw = zlib.decompress(idat)
+    pixels = bytearray()
+    previous = bytearray(width)
+    for y in range(height):
+        row_filter = raw[y * (width + 1)]
+        row = bytearray(raw[y * (width + 1) + 1:(y + 1) * (width + 1)])
+        for x in range(width):
+            left = row[x - 1] if x else 0
+            up = previous[x]
+            up_left = previous[x - 1] if x else 0
+            if row_filter == 1:
+                row[x] = (row[x] + left) & 0xff
+            elif row_filter == 2:
+                row[x] = (row[x] + up) & 0xff
+            elif row_filter == 3:
+                row[x] = (row[x] + ((left + up) >> 1)) & 0xff
+            elif row_filter == 4:
+                row[x] = (row[x] + paeth(left, up, up_left)) & 0xff
+        pixels += row
+        previous = row
+    return width, height, pixels
+
+
+def compare_frame(args, frame, width, height, pixels):
+    """Returns an error message if the frame doesn't match its golden"""
+    name = 'frame_%04d.png' % frame
+    golden_path = os.path.join(args.golden, name)
+
+    if args.update:
+        write_png(golden_path, width, height, pixels)
+        return None
+
+    if not os.path.exists(golden_path):
+        if args.allow_missing:
+            print('%s is missing, skipped' % golden_path)
+            return None
+        return '%s is missing, run scons test update_golden=1' % golden_path
+
+    golden_width, golden_height, golden = read_png(golden_path)
+    if (golden_width, golden_height) != (width, height):
+        return '%s is %dx%d but the screen is %dx%d' % (name, golden_width, golden_height, width, height)
+
+    different = sum(1 for a, b in zip(pixels, golden) if a != b)
+    if different:
+        actual_path = os.path.join(args.output, name)
+        write_png(actual_path, width, height, pixels)
+        return '%s: %d pixels differ, see %s' % (name, different, actual_path)
+
+    return None
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--disk', required=True, help='disk image of the regression build')
+    parser.add_argument('--labels', required=True, help='VICE label file of the regression build')
+    parser.add_argument('--golden', required=True, help='directory of golden images')
+    parser.add_argument('--output', required=True, help='where to put images that differ')
+    parser.add_argument('--frames', default='50,100,200', help='comma separated frames to compare')
+    parser.add_argument('--warmup', type=int, default=2, help='frames to skip before counting sprites')
+    parser.add_argument('--model', default='ntsc', choices=['ntsc', 'pal'])
+    parser.add_argument('--update', action='store_true', help='write new goldens instead of comparing')
+    parser.add_argument('--allow-missing', action='store_true', help='skip frames without a golden instead of failing')
+    args = parser.parse_args()
+
+    labels = read_labels(args.labels)
+    frame_hook = labels['_regress_frame']
+    shown_address = labels['_regress_shown']
+    count_address = labels['_sprite_count']
+
+    golden_frames = sorted(int(frame) for frame in args.frames.split(','))
+    last_frame = golden_frames[-1]
+
+    if not os.path.isdir(args.golden):
+        os.makedirs(args.golden)
+    if not os.path.isdir(args.output):
+        os.makedirs(args.output)
+
+    failures = []
+    dropped_frames = 0
+    vice = Vice(args.disk, model=args.model)
+    try:
+        vice.checkpoint(frame_hook)
+        vice.resume()
+
+        for frame in range(1, last_frame + 1):
+            vice.wait_event(RESPONSE_CHECKPOINT_INFO)
+
+            # The counter still holds the frame that just ended
+            shown = vice.memory(shown_address, 1)[0]
+            count = vice.memory(count_address, 1)[0]
+            if frame > args.warmup and shown < count:
+                dropped_frames += 1
+                failures.append('frame %d: %d of %d sprites shown' % (frame - 1, shown, count))
+
+            if frame in golden_frames:
+                failure = compare_frame(args, frame, *vice.display())
+                if failure:
+                    failures.append(failure)
+
+            vice.resume()
+    finally:
+        vice.close()
+
+    if args.update:
+        print('Wrote %d goldens to %s' % (len(golden_frames), args.golden))
+
+    for failure in failures:
+        print(failure)
+
+    print('%d frames, %d with dropped or torn sprites, %d failures' % (last_frame, dropped_frames, len(failures)))
+
+    return 1 if failures else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,223 @@
+"""Drives VICE headlessly through its binary monitor protocol.
+
+Only the handful of commands the test and profiling tools need are wrapped
+here. See "Binary Monitor" in the VICE manual for the wire format.
+"""
+import os
+import re
+import shutil
+import socket
+import struct
+import subprocess
+import time
+
+STX = 0x02
+API_VERSION = 0x02
+
+CMD_MEMORY_GET = 0x01
+CMD_CHECKPOINT_SET = 0x12
+CMD_CHECKPOINT_DELETE = 0x13
+CMD_REGISTERS_GET = 0x31
+CMD_ADVANCE_INSTRUCTIONS = 0x71
+CMD_REGISTERS_AVAILABLE = 0x83
+CMD_DISPLAY_GET = 0x84
+CMD_EXIT = 0xaa
+CMD_QUIT = 0xbb
+
+RESPONSE_CHECKPOINT_INFO = 0x11
+RESPONSE_REGISTER_INFO = 0x31
+RESPONSE_STOPPED = 0x62
+RESPONSE_RESUMED = 0x63
+
+EVENT_REQUEST_ID = 0xffffffff
+
+MEMSPACE_MAIN = 0x00
+CPU_OP_EXEC = 0x04
+DISPLAY_FORMAT_INDEXED8 = 0x00
+
+# Cycles per raster line and lines per frame
+MODELS = {
+    'ntsc': (65, 263),
+    'pal': (63, 312),
+}
+
+
+class MonitorError(Exception):
+    pass
+
+
+def read_labels(path):
+    """Reads a VICE label file as written by ld65 -Ln into {name: address}"""
+    labels = {}
+    with open(path) as label_file:
+        for line in label_file:
+            match = re.match(r'al\s+([0-9A-Fa-f]+)\s+\.(\S+)', line)
+            if match:
+                labels[match.group(2)] = int(match.group(1), 16)
+    return labels
+
+
+class Vice(object):
+    """A VICE process with a binary monitor connection.
+
+    Any command sent while the emulator is running stops it, so every
+    command is eventually followed by resume().
+    """
+
+    def __init__(self, disk, model='ntsc', port=6502, emulator=None, timeout=60):
+        emulator = emulator or os.environ.get('VICE', 'x64sc')
+        args = [
+            emulator,
+            '-default',
+            '-model', model,
+            '-warp',
+            # The random delay moves the start phase, and the goldens with it
+            '+autostart-delay-random',
+            '+sound',
+            '-binarymonitor',
+            '-binarymonitoraddress', 'ip4://127.0.0.1:%d' % port,
+            '-autostart', disk,
+        ]
+
+        # No display, so wrap it in a virtual one if we can
+        if not os.environ.get('DISPLAY') and shutil.which('xvfb-run'):
+            args = ['xvfb-run', '-a'] + args
+
+        self.process = subprocess.Popen(args, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        self.request_id = 0
+        self.events = []
+        self.last_registers = None
+        self.socket = self._connect(port, timeout)
+
+    def _connect(self, port, timeout):
+        deadline = time.time() + timeout
+        while True:
+            try:
+                connection = socket.create_connection(('127.0.0.1', port))
+                connection.settimeout(timeout)
+                return connection
+            except OSError:
+                if time.time() > deadline or self.process.poll() is not None:
+                    raise MonitorError('Could not connect to the VICE binary monitor')
+                time.sleep(0.25)
+
+    def close(self):
+        try:
+            self.command(CMD_QUIT)
+        except (OSError, MonitorError):
+            pass
+        self.socket.close()
+        try:
+            self.process.wait(5)
+        except subprocess.TimeoutExpired:
+            self.process.kill()
+
+    def _recv(self, length):
+        data = b''
+        while len(data) < length:
+            chunk = self.socket.recv(length - len(data))
+            if not chunk:
+                raise MonitorError('VICE closed the monitor connection')
+            data += chunk
+        return data
+
+    def _read_response(self):
+        header = self._recv(12)
+        stx, api, length, response_type, error, request_id = struct.unpack('<BBIBBI', header)
+        if stx != STX:
+            raise MonitorError('Bad response header')
+        return response_type, error, request_id, self._recv(length)
+
+    def command(self, command_type, body=b''):
+        """Sends a command and returns the body of its response.
+        Events that arrive in the meantime are queued for wait_event."""
+        self.request_id += 1
+        self.socket.sendall(struct.pack('<BBIIB', STX, API_VERSION, len(body), self.request_id, command_type) + body)
+
+        while True:
+            response_type, error, request_id, response = self._read_response()
+            if request_id == self.request_id:
+                if error:
+                    raise MonitorError('Command %02x failed with error %02x' % (command_type, error))
+                return response
+            self.events.append((response_type, response))
+
+    def wait_event(self, event_type):
+        """Waits for an event such as a checkpoint hit and returns its body"""
+        while True:
+            while self.events:
+                response_type, response = self.events.pop(0)
+                if response_type == event_type:
+                    return response
+                # VICE sends the registers along with every stop
+                if response_type == RESPONSE_REGISTER_INFO and hasattr(self, 'register_names'):
+                    self.last_registers = self._parse_registers(response)
+
+            response_type, error, request_id, response = self._read_response()
+            if request_id == EVENT_REQUEST_ID:
+                self.events.append((response_type, response))
+
+    def resume(self):
+        self.command(CMD_EXIT)
+
+    def checkpoint(self, address, temporary=False):
+        """Stops the emulator whenever the CPU executes address"""
+        response = self.command(CMD_CHECKPOINT_SET, struct.pack('<HHBBBB', address, address, 1, 1, CPU_OP_EXEC, int(temporary)))
+        return struct.unpack_from('<I', response)[0]
+
+    def delete_checkpoint(self, number):
+        self.command(CMD_CHECKPOINT_DELETE, struct.pack('<I', number))
+
+    def memory(self, start, length):
+        response = self.command(CMD_MEMORY_GET, struct.pack('<BHHBH', 0, start, start + length - 1, MEMSPACE_MAIN, 0))
+        size = struct.unpack_from('<H', response)[0]
+        return bytearray(response[2:2 + size])
+
+    def registers(self):
+        """Returns the main CPU registers as {name: value}"""
+        if not hasattr(self, 'register_names'):
+            response = self.command(CMD_REGISTERS_AVAILABLE, struct.pack('<B', MEMSPACE_MAIN))
+            count = struct.unpack_from('<H', response)[0]
+            offset = 2
+            self.register_names = {}
+            for i in range(count):
+                size, register_id, bits, name_length = struct.unpack_from('<BBBB', response, offset)
+                name = response[offset + 4:offset + 4 + name_length].decode('ascii')
+                self.register_names[register_id] = name
+                offset += size + 1
+
+        response = self.command(CMD_REGISTERS_GET, struct.pack('<B', MEMSPACE_MAIN))
+        return self._parse_registers(response)
+
+    def _parse_registers(self, response):
+        count = struct.unpack_from('<H', response)[0]
+        offset = 2
+        registers = {}
+        for i in range(count):
+            size, register_id, value = struct.unpack_from('<BBH', response, offset)
+            registers[self.register_names.get(register_id, register_id)] = value
+            offset += size + 1
+        return registers
+
+    def step(self, count=1):
+        """Executes count instructions and returns the PC it stopped at.
+        The registers VICE sends along end up in last_registers."""
+        self.last_registers = None
+        self.command(CMD_ADVANCE_INSTRUCTIONS, struct.pack('<BH', 0, count))
+        return struct.unpack_from('<H', self.wait_event(RESPONSE_STOPPED))[0]
+
+    def display(self):
+        """Returns the visible part of the VIC-II screen as (width, height, pixels)
+        with one palette index per pixel"""
+        response = self.command(CMD_DISPLAY_GET, struct.pack('<BB', 1, DISPLAY_FORMAT_INDEXED8))
+        width, height, offset_x, offset_y, inner_width, inner_height, bits = struct.unpack_from('<HHHHHHB', response, 4)
+        if bits != 8:
+            raise MonitorError('Expected an 8 bit indexed display, got %d bits' % bits)
+        # The buffer is the last thing in the response
+        buffer = response[len(response) - width * height:]
+
+        pixels = bytearray()
+        for y in range(offset_y, offset_y + inner_height):
+            start = y * width + offset_x
+            pixels += buffer[start:start + inner_width]
+        return inner_width, inner_height, pixels